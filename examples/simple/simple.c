@@ -42,8 +42,14 @@ int
 main(void)
 {
     CLEAZY_THREAD("Main");
-    boo(8);
-    CLEAZY_FLUSH("simple.prof");
+    CLEAZY_CAPTURE_OPEN("simple.prof");
+    for (int frame = 0; frame < 4; ++ frame) {
+        CLEAZY_FRAME_BEGIN();
+        boo(8);
+        CLEAZY_FRAME_END();
+        CLEAZY_FLUSH_FRAMES();
+    }
+    CLEAZY_CAPTURE_CLOSE();
     CLEAZY_CLEANUP();
     return EXIT_SUCCESS;
 }
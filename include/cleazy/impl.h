@@ -91,6 +91,42 @@ extern const struct cleazy_dsc cleazy_dsc_push;
  */
 #define CLEAZY_FLUSH(FILENAME) (cleazy_flush(FILENAME))
 
+/*
+ * CLEAZY_FRAME_BEGIN and CLEAZY_FRAME_END mark the boundaries of a
+ * frame, or epoch, on the calling thread: a request tick, a game loop
+ * iteration, etc. Each frame is recorded as a "Frame" block spanning
+ * its duration, so slow frames stand out in the easy_profiler GUI.
+ * Frames don't nest.
+ *
+ * Blocks pushed before the last CLEAZY_FRAME_END on a thread are
+ * complete and may be flushed by CLEAZY_FLUSH_FRAMES while that thread
+ * carries on profiling its current frame.
+ */
+#define CLEAZY_FRAME_BEGIN() (cleazy_frame_begin())
+#define CLEAZY_FRAME_END()   (cleazy_frame_end())
+
+/*
+ * CLEAZY_CAPTURE_OPEN, CLEAZY_FLUSH_FRAMES and CLEAZY_CAPTURE_CLOSE
+ * write completed frames incrementally to a single easy_profiler
+ * v2.1.0 file.
+ *
+ * FILENAME must be a null terminated character array with lifetime
+ * exceeding that of the capture. E.g. a string literal. The file is
+ * only written once the capture is closed; until then thread data is
+ * spooled to a temporary file.
+ *
+ * CLEAZY_FLUSH_FRAMES appends every frame completed since the last
+ * flush, on every thread, to the open capture and frees their memory.
+ * It doesn't require threads to be paused, but only one thread may
+ * flush at a time. Threads which never mark frames aren't flushed.
+ *
+ * Blocks are only ever written once; CLEAZY_FLUSH writes whatever
+ * hasn't already been flushed to a capture.
+ */
+#define CLEAZY_CAPTURE_OPEN(FILENAME) (cleazy_capture_open(FILENAME))
+#define CLEAZY_FLUSH_FRAMES()         (cleazy_flush_frames())
+#define CLEAZY_CAPTURE_CLOSE()        (cleazy_capture_close())
+
 /*
  * CLEAZY_CLEANUP frees allocated memory. This should be called once all
  * threads are complete profiling and data has been flushed to disk.
@@ -115,6 +151,12 @@ extern const struct cleazy_dsc cleazy_dsc_push;
  * cleazy_blk reference descriptors for most of their state, only
  * recording period information which forms the histogram.
  *
+ * cleazy_capture_open, cleazy_flush_frames and cleazy_capture_close
+ * manage the single capture that completed frames are appended to.
+ * cleazy_flush_frames reads each thread's blocks up to its last frame
+ * end, published atomically by cleazy_frame_end, and frees the chunks
+ * behind them. The threads themselves only touch their newest chunk.
+ *
  * cleazy_cleanup frees thread superblocks and all block chunks.
  *
  * cleazy_flush coalesces thread local blocks and writes to a file in
@@ -123,6 +165,9 @@ extern const struct cleazy_dsc cleazy_dsc_push;
  * are left in an empty state. cleazy_pause and cleazy_resume are
  * sufficient to block threads from trampling data during a flush.
  *
+ * cleazy_frame_begin and cleazy_frame_end mark frame boundaries on
+ * the current thread.
+ *
  * cleazy_pause and cleazy_resume pause and resume profiling at runtime.
  *
  * cleazy_push pushes a block onto the thread local history.
@@ -150,8 +195,13 @@ struct cleazy_blk {
     uint64_t end;
 };
 
+void cleazy_capture_close(void);
+void cleazy_capture_open(const char *filename);
 void cleazy_cleanup(void);
 void cleazy_flush(const char *filename);
+void cleazy_flush_frames(void);
+void cleazy_frame_begin(void);
+void cleazy_frame_end(void);
 void cleazy_pause(void);
 void cleazy_push(struct cleazy_blk);
 void cleazy_resume(void);
@@ -14,7 +14,12 @@
 #define CLEAZY_END()
 #define CLEAZY_PAUSE()
 #define CLEAZY_RESUME()
+#define CLEAZY_FRAME_BEGIN()
+#define CLEAZY_FRAME_END()
 #define CLEAZY_FLUSH(...)
+#define CLEAZY_CAPTURE_OPEN(...)
+#define CLEAZY_FLUSH_FRAMES()
+#define CLEAZY_CAPTURE_CLOSE()
 #define CLEAZY_CLEANUP()
 
 #endif /* CLEAZY_STUB_H_ */
@@ -16,6 +16,11 @@ _Static_assert(CLEAZY_DSCLSTINITSZ < SIZE_MAX/sizeof(struct cleazy_dsc),
  * Intrusive linked list of block chunks attached to a superblock and
  * filled by cleazy_push. Rather than realloc and spend geometric time
  * moving data, simply allocate a new chunk when you run out of space.
+ *
+ * Chunks are linked oldest to newest. The owning thread only ever
+ * touches the tail chunk while the flushing thread consumes and frees
+ * chunks from the head, which lets completed frames be flushed without
+ * pausing the thread.
  */
 struct cleazy_blklst {
     struct cleazy_blklst *next;
@@ -26,15 +31,26 @@ struct cleazy_blklst {
  * Thread local superblock keeps threads from stepping on eachother, but
  * also requires us to call cleazy_thread to initialize and
  * cleazy_flush to coalesce data from all threads.
+ *
+ * blklst, blks_flushed and flushed_off belong to whichever thread is
+ * flushing. blktail, blks, blks_count, blks_pushed and frame_begin
+ * belong to the profiled thread. epoch_end is the hand off between the
+ * two: the number of blocks pushed as of the last CLEAZY_FRAME_END.
  */
 struct cleazy_sb {
     struct cleazy_sb     *next;       /* for cleazy_tlist linked list */
-    struct cleazy_blklst *blklst;
+    struct cleazy_blklst *blklst;     /* oldest unflushed chunk */
+    struct cleazy_blklst *blktail;    /* chunk being filled */
     struct cleazy_blk    *blks;
     const char           *thread_name;
     uint64_t              thread_id;
+    uint64_t              frame_begin;
+    uint64_t              blks_pushed;
+    uint64_t              blks_flushed;
+    _Atomic uint64_t      epoch_end;
     /* easy_profiler v2.1.0 file format imposes 2^32 max blocks */
-    uint32_t              blks_count;
+    uint32_t              blks_count;  /* blocks in blktail */
+    uint32_t              flushed_off; /* blocks flushed from blklst */
 };
 _Thread_local struct cleazy_sb *cleazy_tsb;
 
@@ -57,11 +73,84 @@ static atomic_size_t cleazy_tid;
  */
 static atomic_bool cleazy_profiling = 1;
 
+/*
+ * Unique block descriptors seen while flushing, indexed by the block ID
+ * written to file. mem is the total size of their file entries.
+ */
+struct cleazy_dsctbl {
+    const struct cleazy_dsc **dsc;
+    size_t                    sz;
+    uint64_t                  mem;
+    uint32_t                  num;
+};
+
+/*
+ * Capture opened by cleazy_capture_open and appended to by
+ * cleazy_flush_frames. Thread sections are spooled to a temporary file
+ * because the easy_profiler header and descriptors, which precede them,
+ * aren't known until the capture is closed.
+ */
+static struct {
+    FILE                *spool;
+    const char          *filename;
+    struct cleazy_dsctbl dsctbl;
+    uint64_t             first;
+    uint64_t             last;
+    uint64_t             blkmem;
+    uint32_t             blknum;
+    uint32_t             thrdnum;
+} cleazy_capture;
+
+/*
+ * Walks the unflushed blocks of a superblock, oldest first. Only steps
+ * onto the next chunk once a block from it is requested, so it never
+ * reads a link the owning thread hasn't published.
+ */
+struct cleazy_blkit {
+    struct cleazy_blklst *lst;
+    uint32_t              off;
+    uint64_t              remaining;
+};
+
+/*
+ * TODO: Bogus context switch because the easy_profiler gui
+ * complains about zero context switches
+ */
+static const uint32_t cleazy_ctxswnum = 1;
+static const uint16_t cleazy_ctxswsz = 25;
+static const char cleazy_ctxswbogus[25] = { 0 };
+
+static const uint32_t cleazy_sig = ('E' << 24) | ('a' << 16) | ('s' << 8) | 'y';
+
+/*
+ * Block recorded by cleazy_frame_end spanning each frame, so frame
+ * durations show up as top level blocks in the easy_profiler GUI.
+ */
+static const struct cleazy_dsc cleazy_dsc_frame = {
+    .name = "Frame",
+    .file = "cleazy frame",
+    .line = 0,
+    .argb = 0xff808080
+};
+
 /*
  * Geometrically grow the size of our block buffer
  */
 static void cleazy_grow_tld_blks(void);
 
+static struct cleazy_blkit cleazy_blkit_init(const struct cleazy_sb *, uint64_t end);
+static struct cleazy_blk *cleazy_blkit_next(struct cleazy_blkit *);
+static void cleazy_consume(struct cleazy_sb *, uint64_t end);
+static int cleazy_dsctbl_id(struct cleazy_dsctbl *, const struct cleazy_dsc *, uint32_t *id);
+static uint64_t cleazy_thread_mem(const struct cleazy_sb *);
+static void cleazy_write_header(FILE *, uint64_t first, uint64_t last,
+                                uint64_t blkmem, uint64_t dscmem,
+                                uint32_t blknum, uint32_t dscnum,
+                                uint32_t thrdnum);
+static void cleazy_write_dscs(FILE *, const struct cleazy_dsctbl *);
+static void cleazy_write_thread(FILE *, const struct cleazy_sb *, uint32_t blknum);
+static void cleazy_write_blk(FILE *, const struct cleazy_blk *);
+
 /*
  * If self profiling is enabled we need a descriptor to point at.
  * TODO: Should this be conditionally compiled or always available?
@@ -90,6 +179,75 @@ cleazy_nowns(void)
     return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
+void
+cleazy_capture_close(void)
+{
+    if (!cleazy_capture.spool) return;
+
+    FILE *pf = fopen(cleazy_capture.filename, "w");
+    if (!pf) {
+        perror("Error creating/opening cleazy perf file");
+        goto failure_needs_free;
+    }
+
+    cleazy_write_header(pf, cleazy_capture.first, cleazy_capture.last,
+                        cleazy_capture.blkmem, cleazy_capture.dsctbl.mem,
+                        cleazy_capture.blknum, cleazy_capture.dsctbl.num,
+                        cleazy_capture.thrdnum);
+    cleazy_write_dscs(pf, &cleazy_capture.dsctbl);
+
+    /* Copy spooled thread sections */
+    char buf[4096];
+    size_t n;
+    rewind(cleazy_capture.spool);
+    while ((n = fread(buf, 1, sizeof(buf), cleazy_capture.spool)) > 0) {
+        fwrite(buf, 1, n, pf);
+    }
+    if (ferror(cleazy_capture.spool)) {
+        perror("Error reading cleazy capture spool");
+    }
+
+    /*
+     * We don't support bookmarks but I think the signature at the head
+     * of the section is required.
+     */
+    fwrite(&cleazy_sig, sizeof(cleazy_sig), 1, pf);
+
+    if (fclose(pf) != 0) {
+        perror("Error closing cleazy perf file");
+    }
+
+failure_needs_free:
+    fclose(cleazy_capture.spool);
+    free(cleazy_capture.dsctbl.dsc);
+    memset(&cleazy_capture, 0, sizeof(cleazy_capture));
+}
+
+void
+cleazy_capture_open(const char *filename)
+{
+    if (cleazy_capture.spool) {
+        fputs("Error cleazy capture is already open\n", stderr);
+        return;
+    }
+    cleazy_capture.dsctbl.sz  = CLEAZY_DSCLSTINITSZ;
+    cleazy_capture.dsctbl.dsc = malloc(cleazy_capture.dsctbl.sz *
+                                       sizeof *cleazy_capture.dsctbl.dsc);
+    if (!cleazy_capture.dsctbl.dsc) {
+        perror("Error allocating cleazy descriptor array");
+        return;
+    }
+    cleazy_capture.spool = tmpfile();
+    if (!cleazy_capture.spool) {
+        perror("Error creating cleazy capture spool");
+        free(cleazy_capture.dsctbl.dsc);
+        cleazy_capture.dsctbl.dsc = NULL;
+        return;
+    }
+    cleazy_capture.filename = filename;
+    cleazy_capture.first = -1;
+}
+
 void
 cleazy_cleanup(void)
 {
@@ -116,14 +274,6 @@ cleazy_cleanup(void)
 void
 cleazy_flush(const char *filename)
 {
-    /*
-     * TODO: Bogus context switch because the easy_profiler gui
-     * complains about zero context switches
-     */
-    const uint32_t ctxswnum = 1;
-    const uint16_t ctxswsz = 25;
-    const char ctxswbogus[25] = { 0 };
-
     /*
      * Determine number of blocks, unique descriptors, and required mem.
      * This is all fiddly because we don't want to allocate a central
@@ -133,83 +283,35 @@ cleazy_flush(const char *filename)
      * blkmem is wonky because it also encompasses each thread header
      * and context switch info.
      */
-    size_t dscsz = CLEAZY_DSCLSTINITSZ;
-    const struct cleazy_dsc **dsc = malloc(dscsz * sizeof *dsc);
-    if (!dsc) goto dsc_alloc_failed;
-    uint64_t blkmem = 0;
-    uint64_t dscmem = 0;
-    uint32_t blknum = 0;
-    uint32_t dscnum = 0;
-    uint64_t first  = -1;
-    uint64_t last   = 0;
+    struct cleazy_dsctbl dsctbl = { .sz = CLEAZY_DSCLSTINITSZ };
+    dsctbl.dsc = malloc(dsctbl.sz * sizeof *dsctbl.dsc);
+    if (!dsctbl.dsc) goto dsc_alloc_failed;
+    uint64_t blkmem  = 0;
+    uint32_t blknum  = 0;
+    uint32_t thrdnum = 0;
+    uint64_t first   = -1;
+    uint64_t last    = 0;
     struct cleazy_sb *tsb = cleazy_tlist;
     while (tsb) {
-        /* Thread header memory */
-        blkmem += /* hard coded thread header length */
-                  8 + 2 + 4 + 4 +
-                  /* bogus context switch size and single entry */
-                  2 + sizeof(ctxswbogus) / sizeof(*ctxswbogus) +
-                  strlen(tsb->thread_name);
+        blkmem += cleazy_thread_mem(tsb);
+        ++ thrdnum;
         /*
-         * Iterate over this thread's block linked list and sum up mem
+         * Iterate over this thread's unflushed blocks and sum up mem
          * and add unique descriptors.
          */
-        struct cleazy_blklst *blklst = tsb->blklst;
-        uint32_t blks_count = tsb->blks_count;
-        while (blklst) {
-            blknum += blks_count;
-            struct cleazy_blk *blks = blklst->blks;
-            for (uint32_t i = 0; i < blks_count; ++ i) {
-                struct cleazy_blk *blk = blks + i;
-                /* TODO: We don't support runtime block names... Yet. */
-                size_t blknameln = 1;
-                blkmem += /* hard coded block header length */
-                          8 + 8 + 4 + blknameln;
-                uint32_t dscid = -1;
-                for (uint32_t di = 0; di < dscnum; ++ di) {
-                    if (dsc[di] == blk->dsc) {
-                        dscid = di;
-                        break;
-                    }
-                }
-                if (blk->begin < first) first = blk->begin;
-                if (blk->end   > last)  last  = blk->end;
-                if (dscid < (uint32_t)-1) {
-                    blk->dscid = dscid;
-                } else {
-                    dscid = dscnum ++;
-                    dsc[dscid] = blk->dsc;
-                    /* Zero terminated string length */
-                    size_t dscnameln  = strlen(blk->dsc->name) + 1;
-                    size_t filenameln = strlen(blk->dsc->file) + 1;
-                    /* Hard coded descriptor length */
-                    size_t size = 4+4+4+1+1+2 + dscnameln + filenameln;
-                    if (size > (uint16_t)-1 ||
-                        dscmem > ((uint16_t)-1) - size)
-                    {
-                        perror("Error cleazy descriptor length exceeds 2^16-1");
-                        goto failure_needs_free;
-                    }
-                    dscmem += size;
-                    /* grow */
-                    if (dscnum >= dscsz) {
-                        if (dscsz * sizeof *dsc >= SIZE_MAX / 2) {
-                            perror("Error cleazy descriptor size exceeds SIZE_MAX");
-                            goto failure_needs_free;
-                        }
-                        dscsz *= 2;
-                        dsc = realloc(dsc, dscsz * sizeof *dsc);
-                        if (!dsc) {
-                            perror("Error growing cleazy descriptor array");
-                            goto failure_needs_free;
-                        }
-                    }
-                    blk->dscid = dscid;
-                }
+        struct cleazy_blkit it = cleazy_blkit_init(tsb, tsb->blks_pushed);
+        struct cleazy_blk *blk;
+        while ((blk = cleazy_blkit_next(&it))) {
+            ++ blknum;
+            blkmem += /* hard coded block header length */
+                      8 + 8 + 4 + 1;
+            if (blk->begin < first) first = blk->begin;
+            if (blk->end   > last)  last  = blk->end;
+            uint32_t dscid;
+            if (cleazy_dsctbl_id(&dsctbl, blk->dsc, &dscid) != 0) {
+                goto failure_needs_free;
             }
-            /* All blocks besides head are full */
-            blklst = blklst->next;
-            blks_count = CLEAZY_TLDBLKBUFSZ;
+            blk->dscid = dscid;
         }
         tsb = tsb->next;
     }
@@ -220,98 +322,19 @@ cleazy_flush(const char *filename)
         goto failure_needs_free;
     }
 
-    /* Write file header */
-    const uint32_t sig = ('E' << 24) | ('a' << 16) | ('s' << 8) | 'y';
-    const uint32_t ver = (2 << 24) | (1 << 16);
-    const uint64_t pid = 0; /* TODO: Fake process ID */
-    const uint64_t frq = 0; /* TODO: What is CPU frequency / ratio? To scale times? */
-    fwrite(&sig,    sizeof(sig),    1, pf); /* EasyProfiler signature */
-    fwrite(&ver,    sizeof(ver),    1, pf); /* File version */
-    fwrite(&pid,    sizeof(pid),    1, pf); /* Profiled PID */
-    fwrite(&frq,    sizeof(frq),    1, pf); /* CPU frequency / ratio */
-    fwrite(&first,  sizeof(first),  1, pf); /* Begin time */
-    fwrite(&last,   sizeof(last),   1, pf); /* End time */
-    fwrite(&blkmem, sizeof(blkmem), 1, pf);
-    fwrite(&dscmem, sizeof(dscmem), 1, pf);
-    fwrite(&blknum, sizeof(blknum), 1, pf);
-    fwrite(&dscnum, sizeof(dscnum), 1, pf);
-    const uint32_t thrdnum = cleazy_tid;
-    const uint32_t bookmarks_and_padding = 0;
-    fwrite(&thrdnum, sizeof(thrdnum), 1, pf);
-    fwrite(&bookmarks_and_padding, sizeof(bookmarks_and_padding), 1, pf);
-
-    /* Write block descriptors */
-    for (uint32_t i = 0; i < dscnum; ++ i) {
-        const struct cleazy_dsc *d = dsc[i];
-        /*
-         * Zero terminated string length. We don't really care about
-         * uint16_t overflow as we're adding our own termination char.
-         */
-        uint16_t dscnameln  = strlen(d->name) + 1;
-        uint16_t filenameln = strlen(d->file) + 1;
-        /* Hard coded descriptor size */
-        uint16_t size = 4+4+4+1+1+2 + dscnameln + filenameln;
-        uint8_t type   = 1; /* Hardcoded Block */
-        uint8_t status = 1; /* Hardcoded ON */
-        fwrite(&size,      sizeof(size), 1, pf);      /* Size */
-        fwrite(&i,         sizeof(i), 1, pf);         /* Block ID */
-        fwrite(&d->line,   sizeof(d->line), 1, pf);   /* Line number */
-        fwrite(&d->argb,   sizeof(d->argb), 1, pf);   /* ARGB color */
-        fwrite(&type,      sizeof(type), 1, pf);      /* Block type */
-        fwrite(&status,    sizeof(status), 1, pf);    /* Block status */
-        fwrite(&dscnameln, sizeof(dscnameln), 1, pf); /* Name length */
-        fputs(d->name, pf);
-        fputc(0, pf);
-        fputs(d->file, pf);
-        fputc(0, pf);
-    }
+    cleazy_write_header(pf, first, last, blkmem, dsctbl.mem,
+                        blknum, dsctbl.num, thrdnum);
+    cleazy_write_dscs(pf, &dsctbl);
 
     /* Write thread events and blocks */
     tsb = cleazy_tlist;
     while (tsb) {
-        /* Thread header */
-        /* TODO: Address as thread ID, probably not a great idea */
-        _Static_assert(sizeof(tsb) == 8, "");
-        fwrite(&tsb, sizeof(tsb), 1, pf);
-        /* TODO: Thread name doesn't seem to be null terminated */
-        uint16_t tnameln = strlen(tsb->thread_name);
-        fwrite(&tnameln, sizeof(tnameln), 1, pf);
-        fwrite(tsb->thread_name, 1, tnameln, pf);
-        /*
-         * TODO: Bogus context switch because the easy_profiler gui
-         * complains about zero context switches
-         */
-        fwrite(&ctxswnum, sizeof(ctxswnum), 1, pf);
-        fwrite(&ctxswsz, sizeof(ctxswsz), 1, pf);
-        fwrite(ctxswbogus, 1, ctxswsz, pf);
-        /* Count blocks */
-        uint32_t total_blk_count = tsb->blks_count;
-        struct cleazy_blklst *head = tsb->blklst;
-        while (head->next) {
-            total_blk_count += CLEAZY_TLDBLKBUFSZ;
-            head = head->next;
-        }
-        fwrite(&total_blk_count, sizeof(total_blk_count), 1, pf);
-        /* Block data */
-        struct cleazy_blklst *blklst = tsb->blklst;
-        uint32_t blks_count = tsb->blks_count;
-        while (blklst) {
-            struct cleazy_blk *blks = blklst->blks;
-            for (uint32_t i = 0; i < blks_count; ++ i) {
-                const struct cleazy_blk *blk = blks + i;
-                uint16_t size  = 8+8+4 + 1; /* hard coded block len */
-                uint64_t begin = blk->begin;
-                uint64_t end   = blk->end;
-                uint32_t blkid = blk->dscid;
-                fwrite(&size, sizeof(size), 1, pf);
-                fwrite(&begin, sizeof(begin), 1, pf);
-                fwrite(&end, sizeof(end), 1, pf);
-                fwrite(&blkid, sizeof(blkid), 1, pf);
-                fputc(0, pf); /* No runtime block name support */
-            }
-            /* All blocks besides head are full */
-            blklst = blklst->next;
-            blks_count = CLEAZY_TLDBLKBUFSZ;
+        uint64_t end = tsb->blks_pushed;
+        cleazy_write_thread(pf, tsb, end - tsb->blks_flushed);
+        struct cleazy_blkit it = cleazy_blkit_init(tsb, end);
+        const struct cleazy_blk *blk;
+        while ((blk = cleazy_blkit_next(&it))) {
+            cleazy_write_blk(pf, blk);
         }
         tsb = tsb->next;
     }
@@ -320,33 +343,126 @@ cleazy_flush(const char *filename)
      * We don't support bookmarks but I think the signature at the head
      * of the section is required.
      */
-    fwrite(&sig, sizeof(sig), 1, pf);
+    fwrite(&cleazy_sig, sizeof(cleazy_sig), 1, pf);
 
     if (fclose(pf) != 0) {
         perror("Error closing cleazy perf file");
     }
 
 failure_needs_free: ;
-    /* Free all but first block lists */
+    /* Free all but the chunk each thread is filling and start over */
     struct cleazy_sb *tlist_head = cleazy_tlist;
     while (tlist_head) {
-        struct cleazy_sb *tlist_tail = tlist_head->next;
-        struct cleazy_blklst *blklst_head = tlist_head->blklst->next;
-        tlist_head->blklst->next = NULL;
+        cleazy_consume(tlist_head, tlist_head->blks_pushed);
         tlist_head->blks = tlist_head->blklst->blks;
-        tlist_head->blks_count = 0;
-        while (blklst_head) {
-            struct cleazy_blklst *blklst_next = blklst_head->next;
-            free(blklst_head);
-            blklst_head = blklst_next;
-        }
-        tlist_head = tlist_tail;
+        tlist_head->blks_count   = 0;
+        tlist_head->blks_pushed  = 0;
+        tlist_head->blks_flushed = 0;
+        tlist_head->flushed_off  = 0;
+        atomic_store(&tlist_head->epoch_end, 0);
+        tlist_head = tlist_head->next;
     }
-    free(dsc);
+    free(dsctbl.dsc);
 dsc_alloc_failed:
     return;
 }
 
+/*
+ * Threads are free to keep profiling the frame they're in. We only read
+ * blocks pushed before each thread's last published frame end.
+ *
+ * Like cleazy_flush, each thread's blocks are resolved against the
+ * descriptor table before anything is spooled. On failure the blocks
+ * that couldn't be written are discarded, leaving the capture valid.
+ */
+void
+cleazy_flush_frames(void)
+{
+    if (!cleazy_capture.spool) {
+        fputs("Error flushing cleazy frames without an open capture\n", stderr);
+        return;
+    }
+    struct cleazy_sb *tsb = cleazy_tlist;
+    while (tsb) {
+        uint64_t end = atomic_load_explicit(&tsb->epoch_end,
+                                            memory_order_acquire);
+        if (end <= tsb->blks_flushed) {
+            tsb = tsb->next;
+            continue;
+        }
+        /* easy_profiler v2.1.0 file format imposes 2^32 max blocks */
+        uint64_t blknum = end - tsb->blks_flushed;
+        if (blknum > (uint32_t)-1 ||
+            cleazy_capture.blknum > (uint32_t)-1 - blknum ||
+            cleazy_capture.thrdnum == (uint32_t)-1)
+        {
+            fputs("Error cleazy capture block count exceeds 2^32-1\n", stderr);
+            cleazy_consume(tsb, end);
+            return;
+        }
+
+        /* Resolve descriptors and time span */
+        const uint32_t dscnum = cleazy_capture.dsctbl.num;
+        const uint64_t dscmem = cleazy_capture.dsctbl.mem;
+        uint64_t first = cleazy_capture.first;
+        uint64_t last  = cleazy_capture.last;
+        struct cleazy_blkit it = cleazy_blkit_init(tsb, end);
+        struct cleazy_blk *blk;
+        while ((blk = cleazy_blkit_next(&it))) {
+            if (blk->begin < first) first = blk->begin;
+            if (blk->end   > last)  last  = blk->end;
+            uint32_t dscid;
+            if (cleazy_dsctbl_id(&cleazy_capture.dsctbl, blk->dsc, &dscid) != 0) {
+                /*
+                 * Drop descriptors only this section would have used.
+                 * Some blocks already hold IDs, so can't be retried.
+                 */
+                cleazy_capture.dsctbl.num = dscnum;
+                cleazy_capture.dsctbl.mem = dscmem;
+                cleazy_consume(tsb, end);
+                return;
+            }
+            blk->dscid = dscid;
+        }
+
+        /* Spool thread section */
+        cleazy_capture.first   = first;
+        cleazy_capture.last    = last;
+        cleazy_capture.blkmem += cleazy_thread_mem(tsb) +
+                                 /* hard coded block header length */
+                                 blknum * (8 + 8 + 4 + 1);
+        cleazy_capture.blknum += blknum;
+        ++ cleazy_capture.thrdnum;
+        cleazy_write_thread(cleazy_capture.spool, tsb, blknum);
+        it = cleazy_blkit_init(tsb, end);
+        while ((blk = cleazy_blkit_next(&it))) {
+            cleazy_write_blk(cleazy_capture.spool, blk);
+        }
+        cleazy_consume(tsb, end);
+        tsb = tsb->next;
+    }
+}
+
+void
+cleazy_frame_begin(void)
+{
+    cleazy_tsb->frame_begin = cleazy_nowns();
+}
+
+void
+cleazy_frame_end(void)
+{
+    if (!cleazy_profiling) return;
+    struct cleazy_blk blk = {
+        .dsc = &cleazy_dsc_frame,
+        .begin = cleazy_tsb->frame_begin,
+        .end = cleazy_nowns()
+    };
+    cleazy_push(blk);
+    atomic_store_explicit(&cleazy_tsb->epoch_end, cleazy_tsb->blks_pushed,
+                          memory_order_release);
+}
+
 void
 cleazy_push(struct cleazy_blk blk)
 {
@@ -355,6 +471,7 @@ cleazy_push(struct cleazy_blk blk)
         cleazy_grow_tld_blks();
     }
     cleazy_tsb->blks[cleazy_tsb->blks_count ++] = blk;
+    ++ cleazy_tsb->blks_pushed;
 }
 
 void
@@ -366,11 +483,22 @@ cleazy_thread(const char *thread_name)
         exit(EXIT_FAILURE);
     }
     cleazy_tsb->blklst = NULL;
+    cleazy_tsb->blktail = NULL;
     cleazy_tsb->thread_name = thread_name;
     cleazy_tsb->thread_id = cleazy_tid ++;
+    cleazy_tsb->frame_begin = cleazy_nowns();
+    cleazy_tsb->blks_pushed = 0;
+    cleazy_tsb->blks_flushed = 0;
+    cleazy_tsb->flushed_off = 0;
+    atomic_init(&cleazy_tsb->epoch_end, 0);
     cleazy_grow_tld_blks();
-    /* build a linked list of thread superblocks */
-    cleazy_tsb->next = atomic_exchange(&cleazy_tlist, cleazy_tsb);
+    /*
+     * Build a linked list of thread superblocks. Link before publishing
+     * as cleazy_flush_frames may be walking the list concurrently.
+     */
+    cleazy_tsb->next = atomic_load(&cleazy_tlist);
+    while (!atomic_compare_exchange_weak(&cleazy_tlist, &cleazy_tsb->next,
+                                         cleazy_tsb));
 }
 
 void
@@ -388,11 +516,16 @@ cleazy_resume(void)
 static void
 cleazy_grow_tld_blks(void)
 {
-    struct cleazy_blklst *oldlst = cleazy_tsb->blklst;
-    cleazy_tsb->blklst = malloc(sizeof *cleazy_tsb->blklst);
-    if (cleazy_tsb->blklst) {
-        cleazy_tsb->blks = cleazy_tsb->blklst->blks;
-        cleazy_tsb->blklst->next = oldlst;
+    struct cleazy_blklst *newlst = malloc(sizeof *newlst);
+    if (newlst) {
+        newlst->next = NULL;
+        if (cleazy_tsb->blktail) {
+            cleazy_tsb->blktail->next = newlst;
+        } else {
+            cleazy_tsb->blklst = newlst;
+        }
+        cleazy_tsb->blktail = newlst;
+        cleazy_tsb->blks = newlst->blks;
         cleazy_tsb->blks_count = 0;
     } else {
         /*
@@ -403,3 +536,185 @@ cleazy_grow_tld_blks(void)
         exit(EXIT_FAILURE);
     }
 }
+
+static struct cleazy_blkit
+cleazy_blkit_init(const struct cleazy_sb *tsb, uint64_t end)
+{
+    return (struct cleazy_blkit) {
+        .lst = tsb->blklst,
+        .off = tsb->flushed_off,
+        .remaining = end - tsb->blks_flushed
+    };
+}
+
+static struct cleazy_blk *
+cleazy_blkit_next(struct cleazy_blkit *it)
+{
+    if (it->remaining == 0) return NULL;
+    if (it->off >= CLEAZY_TLDBLKBUFSZ) {
+        it->lst = it->lst->next;
+        it->off = 0;
+    }
+    -- it->remaining;
+    return it->lst->blks + it->off ++;
+}
+
+/*
+ * Mark blocks up to end as flushed and free chunks left behind. The
+ * chunk holding the last flushed block is kept, even if full, because
+ * its owning thread may not have linked a successor yet.
+ */
+static void
+cleazy_consume(struct cleazy_sb *tsb, uint64_t end)
+{
+    uint64_t remaining = end - tsb->blks_flushed;
+    while (remaining > CLEAZY_TLDBLKBUFSZ - tsb->flushed_off) {
+        remaining -= CLEAZY_TLDBLKBUFSZ - tsb->flushed_off;
+        struct cleazy_blklst *blklst_next = tsb->blklst->next;
+        free(tsb->blklst);
+        tsb->blklst = blklst_next;
+        tsb->flushed_off = 0;
+    }
+    tsb->flushed_off += remaining;
+    tsb->blks_flushed = end;
+}
+
+/*
+ * Looks up the file block ID of a descriptor, adding it to the table
+ * if unseen. Returns nonzero on failure.
+ */
+static int
+cleazy_dsctbl_id(struct cleazy_dsctbl *tbl, const struct cleazy_dsc *dsc,
+                 uint32_t *id)
+{
+    for (uint32_t di = 0; di < tbl->num; ++ di) {
+        if (tbl->dsc[di] == dsc) {
+            *id = di;
+            return 0;
+        }
+    }
+    /* Zero terminated string length */
+    size_t dscnameln  = strlen(dsc->name) + 1;
+    size_t filenameln = strlen(dsc->file) + 1;
+    /* Hard coded descriptor length */
+    size_t size = 4+4+4+1+1+2 + dscnameln + filenameln;
+    if (size > (uint16_t)-1 || tbl->mem > ((uint16_t)-1) - size) {
+        perror("Error cleazy descriptor length exceeds 2^16-1");
+        return -1;
+    }
+    /* grow */
+    if (tbl->num >= tbl->sz) {
+        if (tbl->sz * sizeof *tbl->dsc >= SIZE_MAX / 2) {
+            perror("Error cleazy descriptor size exceeds SIZE_MAX");
+            return -1;
+        }
+        const struct cleazy_dsc **grown = realloc(tbl->dsc, 2 * tbl->sz * sizeof *tbl->dsc);
+        if (!grown) {
+            perror("Error growing cleazy descriptor array");
+            return -1;
+        }
+        tbl->dsc = grown;
+        tbl->sz *= 2;
+    }
+    tbl->mem += size;
+    *id = tbl->num ++;
+    tbl->dsc[*id] = dsc;
+    return 0;
+}
+
+static uint64_t
+cleazy_thread_mem(const struct cleazy_sb *tsb)
+{
+    return /* hard coded thread header length */
+           8 + 2 + 4 + 4 +
+           /* bogus context switch size and single entry */
+           2 + sizeof(cleazy_ctxswbogus) / sizeof(*cleazy_ctxswbogus) +
+           strlen(tsb->thread_name);
+}
+
+static void
+cleazy_write_header(FILE *pf, uint64_t first, uint64_t last,
+                    uint64_t blkmem, uint64_t dscmem,
+                    uint32_t blknum, uint32_t dscnum, uint32_t thrdnum)
+{
+    const uint32_t ver = (2 << 24) | (1 << 16);
+    const uint64_t pid = 0; /* TODO: Fake process ID */
+    const uint64_t frq = 0; /* TODO: What is CPU frequency / ratio? To scale times? */
+    fwrite(&cleazy_sig, sizeof(cleazy_sig), 1, pf); /* EasyProfiler signature */
+    fwrite(&ver,    sizeof(ver),    1, pf); /* File version */
+    fwrite(&pid,    sizeof(pid),    1, pf); /* Profiled PID */
+    fwrite(&frq,    sizeof(frq),    1, pf); /* CPU frequency / ratio */
+    fwrite(&first,  sizeof(first),  1, pf); /* Begin time */
+    fwrite(&last,   sizeof(last),   1, pf); /* End time */
+    fwrite(&blkmem, sizeof(blkmem), 1, pf);
+    fwrite(&dscmem, sizeof(dscmem), 1, pf);
+    fwrite(&blknum, sizeof(blknum), 1, pf);
+    fwrite(&dscnum, sizeof(dscnum), 1, pf);
+    const uint32_t bookmarks_and_padding = 0;
+    fwrite(&thrdnum, sizeof(thrdnum), 1, pf);
+    fwrite(&bookmarks_and_padding, sizeof(bookmarks_and_padding), 1, pf);
+}
+
+static void
+cleazy_write_dscs(FILE *pf, const struct cleazy_dsctbl *tbl)
+{
+    for (uint32_t i = 0; i < tbl->num; ++ i) {
+        const struct cleazy_dsc *d = tbl->dsc[i];
+        /*
+         * Zero terminated string length. We don't really care about
+         * uint16_t overflow as we're adding our own termination char.
+         */
+        uint16_t dscnameln  = strlen(d->name) + 1;
+        uint16_t filenameln = strlen(d->file) + 1;
+        /* Hard coded descriptor size */
+        uint16_t size = 4+4+4+1+1+2 + dscnameln + filenameln;
+        uint8_t type   = 1; /* Hardcoded Block */
+        uint8_t status = 1; /* Hardcoded ON */
+        fwrite(&size,      sizeof(size), 1, pf);      /* Size */
+        fwrite(&i,         sizeof(i), 1, pf);         /* Block ID */
+        fwrite(&d->line,   sizeof(d->line), 1, pf);   /* Line number */
+        fwrite(&d->argb,   sizeof(d->argb), 1, pf);   /* ARGB color */
+        fwrite(&type,      sizeof(type), 1, pf);      /* Block type */
+        fwrite(&status,    sizeof(status), 1, pf);    /* Block status */
+        fwrite(&dscnameln, sizeof(dscnameln), 1, pf); /* Name length */
+        fputs(d->name, pf);
+        fputc(0, pf);
+        fputs(d->file, pf);
+        fputc(0, pf);
+    }
+}
+
+/*
+ * Writes a thread header, to be followed by blknum blocks. The same
+ * thread may have several sections in a capture, one per frame flush,
+ * which easy_profiler merges by thread ID.
+ */
+static void
+cleazy_write_thread(FILE *pf, const struct cleazy_sb *tsb, uint32_t blknum)
+{
+    /* TODO: Address as thread ID, probably not a great idea */
+    _Static_assert(sizeof(tsb) == 8, "");
+    fwrite(&tsb, sizeof(tsb), 1, pf);
+    /* TODO: Thread name doesn't seem to be null terminated */
+    uint16_t tnameln = strlen(tsb->thread_name);
+    fwrite(&tnameln, sizeof(tnameln), 1, pf);
+    fwrite(tsb->thread_name, 1, tnameln, pf);
+    fwrite(&cleazy_ctxswnum, sizeof(cleazy_ctxswnum), 1, pf);
+    fwrite(&cleazy_ctxswsz, sizeof(cleazy_ctxswsz), 1, pf);
+    fwrite(cleazy_ctxswbogus, 1, cleazy_ctxswsz, pf);
+    fwrite(&blknum, sizeof(blknum), 1, pf);
+}
+
+static void
+cleazy_write_blk(FILE *pf, const struct cleazy_blk *blk)
+{
+    uint16_t size  = 8+8+4 + 1; /* hard coded block len */
+    uint64_t begin = blk->begin;
+    uint64_t end   = blk->end;
+    uint32_t blkid = blk->dscid;
+    fwrite(&size, sizeof(size), 1, pf);
+    fwrite(&begin, sizeof(begin), 1, pf);
+    fwrite(&end, sizeof(end), 1, pf);
+    fwrite(&blkid, sizeof(blkid), 1, pf);
+    fputc(0, pf); /* No runtime block name support */
+}